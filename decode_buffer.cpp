@@ -0,0 +1,173 @@
+/// This Source Code Form is subject to the terms of the Mozilla Public
+/// License, v. 2.0. If a copy of the MPL was not distributed with this
+/// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#include "decode_buffer.h"
+
+#include <algorithm>
+#include <atomic>
+#include <new>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+namespace ghassanpl
+{
+#if defined(_WIN32) && !defined(_WINDOWS_)
+  extern "C" __declspec(dllimport) void* __stdcall VirtualAlloc(void* lpAddress, size_t dwSize, unsigned long flAllocationType, unsigned long flProtect);
+  extern "C" __declspec(dllimport) int __stdcall VirtualFree(void* lpAddress, size_t dwSize, unsigned long dwFreeType);
+  extern "C" __declspec(dllimport) size_t __stdcall GetLargePageMinimum();
+  extern "C" __declspec(dllimport) void* __stdcall GetCurrentProcess();
+  extern "C" __declspec(dllimport) int __stdcall CloseHandle(void* hObject);
+  extern "C" __declspec(dllimport) unsigned long __stdcall GetLastError();
+
+  extern "C" struct LUID {
+    unsigned long LowPart;
+    long HighPart;
+  };
+
+  extern "C" struct LUID_AND_ATTRIBUTES {
+    LUID Luid;
+    unsigned long Attributes;
+  };
+
+  extern "C" struct TOKEN_PRIVILEGES {
+    unsigned long PrivilegeCount;
+    LUID_AND_ATTRIBUTES Privileges[1];
+  };
+
+  extern "C" __declspec(dllimport) int __stdcall OpenProcessToken(void* ProcessHandle, unsigned long DesiredAccess, void** TokenHandle);
+  extern "C" __declspec(dllimport) int __stdcall LookupPrivilegeValueW(const wchar_t* lpSystemName, const wchar_t* lpName, LUID* lpLuid);
+  extern "C" __declspec(dllimport) int __stdcall AdjustTokenPrivileges(void* TokenHandle, int DisableAllPrivileges, TOKEN_PRIVILEGES* NewState, unsigned long BufferLength, TOKEN_PRIVILEGES* PreviousState, unsigned long* ReturnLength);
+#endif
+
+  namespace
+  {
+    std::atomic<size_t> pool_size{ 0 };
+    std::atomic<size_t> peak_pool_size{ 0 };
+#ifdef _WIN32
+    /// Zero until `enable_large_pages()` succeeds
+    std::atomic<size_t> large_page_size{ 0 };
+#endif
+
+    inline size_t round_up(size_t size, size_t alignment) noexcept
+    {
+      return (size + alignment - 1) / alignment * alignment;
+    }
+
+    inline void add_to_pool_size(size_t size) noexcept
+    {
+      const auto new_size = pool_size.fetch_add(size) + size;
+      auto peak = peak_pool_size.load();
+      while (peak < new_size && !peak_pool_size.compare_exchange_weak(peak, new_size)) {}
+    }
+
+    /// Fresh anonymous pages are supplied by the OS on first touch, so nothing is memset here
+    uint8_t* allocate_pages(size_t size)
+    {
+#ifdef _WIN32
+      void* result = nullptr;
+      // Large page allocations must be a multiple of the large page size; they can also fail when physical memory
+      // is too fragmented, so ordinary pages remain the fallback
+      if (const auto large_page = large_page_size.load(); large_page && size >= decode_buffer::huge_page_threshold && size % large_page == 0)
+      {
+        // MEM_COMMIT | MEM_RESERVE | MEM_LARGE_PAGES, PAGE_READWRITE
+        result = VirtualAlloc(nullptr, size, 0x00001000 | 0x00002000 | 0x20000000, 0x04);
+      }
+      // MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE
+      if (!result)
+        result = VirtualAlloc(nullptr, size, 0x00001000 | 0x00002000, 0x04);
+      if (!result)
+        throw std::bad_alloc{};
+#else // POSIX
+      void* result = ::mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if (result == MAP_FAILED)
+        throw std::bad_alloc{};
+#ifdef MADV_HUGEPAGE
+      // Only a hint; if THP is disabled we just get regular pages
+      if (size >= decode_buffer::huge_page_threshold)
+        ::madvise(result, size, MADV_HUGEPAGE);
+#endif
+#endif
+      return static_cast<uint8_t*>(result);
+    }
+
+    void free_pages(uint8_t* data, size_t size) noexcept
+    {
+#ifdef _WIN32
+      // MEM_RELEASE
+      VirtualFree(data, 0, 0x00008000);
+#else // POSIX
+      ::munmap(data, size);
+#endif
+    }
+  }
+
+  uint8_t* decode_buffer::reserve(size_t size)
+  {
+    if (size <= capacity_)
+      return data_;
+
+    auto new_capacity = std::max({ size, capacity_ * 2, minimum_capacity });
+    new_capacity = round_up(new_capacity, new_capacity >= huge_page_threshold ? huge_page_threshold : minimum_capacity);
+
+    // The old contents are not needed, so free them first instead of holding both buffers at once
+    release();
+    data_ = allocate_pages(new_capacity);
+    capacity_ = new_capacity;
+    add_to_pool_size(capacity_);
+    return data_;
+  }
+
+  void decode_buffer::release() noexcept
+  {
+    if (!data_)
+      return;
+    free_pages(data_, capacity_);
+    pool_size -= capacity_;
+    data_ = nullptr;
+    capacity_ = 0;
+  }
+
+  decode_buffer& thread_decode_buffer()
+  {
+    thread_local decode_buffer buffer;
+    return buffer;
+  }
+
+  bool enable_large_pages() noexcept
+  {
+#ifdef _WIN32
+    const auto minimum = GetLargePageMinimum();
+    if (minimum == 0)
+      return false;
+
+    void* token = nullptr;
+    // TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY
+    if (!OpenProcessToken(GetCurrentProcess(), 0x0020 | 0x0008, &token))
+      return false;
+
+    TOKEN_PRIVILEGES privileges{};
+    privileges.PrivilegeCount = 1;
+    // SE_PRIVILEGE_ENABLED
+    privileges.Privileges[0].Attributes = 0x00000002;
+    const bool enabled = LookupPrivilegeValueW(nullptr, L"SeLockMemoryPrivilege", &privileges.Privileges[0].Luid)
+      && AdjustTokenPrivileges(token, 0, &privileges, 0, nullptr, nullptr)
+      // AdjustTokenPrivileges succeeds with ERROR_NOT_ALL_ASSIGNED when the account does not hold the privilege
+      && GetLastError() == 0;
+    CloseHandle(token);
+
+    if (enabled)
+      large_page_size = minimum;
+    return enabled;
+#else
+    return true;
+#endif
+  }
+
+  size_t peak_decode_buffer_pool_size() noexcept
+  {
+    return peak_pool_size.load();
+  }
+}
@@ -0,0 +1,67 @@
+/// This Source Code Form is subject to the terms of the Mozilla Public
+/// License, v. 2.0. If a copy of the MPL was not distributed with this
+/// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <utility>
+
+namespace ghassanpl
+{
+  /// A reusable scratch buffer for decoded asset data.
+  /// Its memory is never zero-filled by us and its capacity only ever grows (geometrically).
+  /// Buffers of `huge_page_threshold` bytes or more are backed by huge pages: on Linux through transparent huge pages,
+  /// on Windows only after a successful `enable_large_pages()`.
+  struct decode_buffer
+  {
+    static constexpr size_t minimum_capacity = 64 * 1024;
+    static constexpr size_t huge_page_threshold = 2 * 1024 * 1024;
+
+    decode_buffer() = default;
+    ~decode_buffer() noexcept { release(); }
+
+    decode_buffer(const decode_buffer&) = delete;
+    decode_buffer(decode_buffer&& other) noexcept
+      : data_(std::exchange(other.data_, nullptr))
+      , capacity_(std::exchange(other.capacity_, 0))
+    {
+    }
+    decode_buffer& operator=(const decode_buffer&) = delete;
+    decode_buffer& operator=(decode_buffer&& other) noexcept
+    {
+      if (this != &other)
+      {
+        release();
+        data_ = std::exchange(other.data_, nullptr);
+        capacity_ = std::exchange(other.capacity_, 0);
+      }
+      return *this;
+    }
+
+    /// Returns a buffer of at least `size` bytes. The previous contents are NOT preserved if the buffer has to grow.
+    uint8_t* reserve(size_t size);
+
+    uint8_t* data() const noexcept { return data_; }
+    size_t capacity() const noexcept { return capacity_; }
+
+    void release() noexcept;
+
+  private:
+
+    uint8_t* data_ = nullptr;
+    size_t capacity_ = 0;
+  };
+
+  /// Returns the decode buffer owned by the calling thread
+  decode_buffer& thread_decode_buffer();
+
+  /// Lets large decode buffers use Windows large pages (MEM_LARGE_PAGES). This needs the "Lock pages in memory"
+  /// privilege (SeLockMemoryPrivilege); returns false if it could not be enabled, in which case ordinary pages are used.
+  /// Always succeeds elsewhere, as transparent huge pages are only ever a hint.
+  bool enable_large_pages() noexcept;
+
+  /// The largest total capacity held by all decode buffers at any one time
+  size_t peak_decode_buffer_pool_size() noexcept;
+}
@@ -0,0 +1,216 @@
+/// This Source Code Form is subject to the terms of the Mozilla Public
+/// License, v. 2.0. If a copy of the MPL was not distributed with this
+/// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#include "decompress.h"
+
+#include <algorithm>
+#include <climits>
+#include <stdexcept>
+#include <zlib.h>
+#include <zstd.h>
+
+namespace ghassanpl
+{
+  compression_format detect_compression(const std::byte* data, size_t size) noexcept
+  {
+    const auto bytes = reinterpret_cast<const unsigned char*>(data);
+    if (size >= 2 && bytes[0] == 0x1F && bytes[1] == 0x8B)
+      return compression_format::gzip;
+    if (size >= 4 && bytes[0] == 0x28 && bytes[1] == 0xB5 && bytes[2] == 0x2F && bytes[3] == 0xFD)
+      return compression_format::zstd;
+    return compression_format::none;
+  }
+
+  decompressing_streambuf::decompressing_streambuf(mmap_source source, compression_format format, size_t chunk_size, size_t chunk_count)
+    : source_(std::move(source))
+    , chunk_size_(chunk_size)
+    , chunks_(std::max<size_t>(chunk_count, 2))
+  {
+    for (auto& chunk : chunks_)
+      chunk.data = std::make_unique<char[]>(chunk_size_);
+
+    thread_ = std::thread{ &decompressing_streambuf::decompress, this, format };
+  }
+
+  decompressing_streambuf::~decompressing_streambuf()
+  {
+    {
+      std::lock_guard lock{ mutex_ };
+      cancelled_ = true;
+    }
+    chunk_freed_.notify_all();
+    thread_.join();
+  }
+
+  decompressing_streambuf::int_type decompressing_streambuf::underflow()
+  {
+    std::unique_lock lock{ mutex_ };
+
+    if (reading_chunk_)
+    {
+      read_index_ = (read_index_ + 1) % chunks_.size();
+      --filled_count_;
+      reading_chunk_ = false;
+      chunk_freed_.notify_one();
+    }
+
+    chunk_filled_.wait(lock, [this] { return filled_count_ > 0 || finished_; });
+    if (filled_count_ == 0)
+    {
+      setg(nullptr, nullptr, nullptr);
+      if (error_)
+        std::rethrow_exception(error_);
+      return traits_type::eof();
+    }
+
+    auto& chunk = chunks_[read_index_];
+    reading_chunk_ = true;
+    setg(chunk.data.get(), chunk.data.get(), chunk.data.get() + chunk.size);
+    return traits_type::to_int_type(*gptr());
+  }
+
+  void decompressing_streambuf::decompress(compression_format format)
+  {
+    try
+    {
+      switch (format)
+      {
+      case compression_format::gzip: inflate_gzip(); break;
+      case compression_format::zstd: decompress_zstd(); break;
+      default: throw std::invalid_argument("input is not compressed");
+      }
+    }
+    catch (...)
+    {
+      std::lock_guard lock{ mutex_ };
+      error_ = std::current_exception();
+    }
+
+    {
+      std::lock_guard lock{ mutex_ };
+      finished_ = true;
+    }
+    chunk_filled_.notify_one();
+  }
+
+  void decompressing_streambuf::inflate_gzip()
+  {
+    z_stream stream{};
+    if (inflateInit2(&stream, 15 + 16) != Z_OK)
+      throw std::runtime_error("could not initialize gzip decompression");
+    std::unique_ptr<z_stream, int(*)(z_stream*)> stream_guard{ &stream, &inflateEnd };
+
+    auto input = reinterpret_cast<const Bytef*>(source_.data());
+    size_t input_left = source_.size();
+
+    bool stream_end = false;
+    while (!stream_end)
+    {
+      const auto output = acquire_chunk();
+      if (!output)
+        return;
+
+      stream.next_out = reinterpret_cast<Bytef*>(output);
+      stream.avail_out = static_cast<uInt>(chunk_size_);
+
+      bool truncated = false;
+      while (stream.avail_out > 0)
+      {
+        if (stream.avail_in == 0 && input_left > 0)
+        {
+          stream.next_in = const_cast<Bytef*>(input);
+          stream.avail_in = static_cast<uInt>(std::min<size_t>(input_left, UINT_MAX));
+          input += stream.avail_in;
+          input_left -= stream.avail_in;
+        }
+
+        const auto result = inflate(&stream, Z_NO_FLUSH);
+        if (result == Z_STREAM_END)
+        {
+          if (stream.avail_in == 0 && input_left == 0)
+          {
+            stream_end = true;
+            break;
+          }
+          // Concatenated gzip members decompress to the concatenation of their contents
+          inflateReset(&stream);
+        }
+        else if (result == Z_BUF_ERROR && stream.avail_in == 0 && input_left == 0)
+        {
+          truncated = true;
+          break;
+        }
+        else if (result != Z_OK)
+          throw std::runtime_error(stream.msg ? stream.msg : "corrupt gzip data");
+      }
+
+      if (const auto produced = chunk_size_ - stream.avail_out; produced > 0)
+        publish_chunk(produced);
+
+      if (truncated)
+        throw std::runtime_error("truncated gzip data");
+    }
+  }
+
+  void decompressing_streambuf::decompress_zstd()
+  {
+    std::unique_ptr<ZSTD_DCtx, size_t(*)(ZSTD_DCtx*)> context{ ZSTD_createDCtx(), &ZSTD_freeDCtx };
+    if (!context)
+      throw std::runtime_error("could not initialize zstd decompression");
+
+    ZSTD_inBuffer input{ source_.data(), source_.size(), 0 };
+    size_t last_result = 0;
+
+    while (true)
+    {
+      const auto output_data = acquire_chunk();
+      if (!output_data)
+        return;
+
+      ZSTD_outBuffer output{ output_data, chunk_size_, 0 };
+      bool input_done = false;
+      while (output.pos < output.size)
+      {
+        last_result = ZSTD_decompressStream(context.get(), &output, &input);
+        if (ZSTD_isError(last_result))
+          throw std::runtime_error(ZSTD_getErrorName(last_result));
+
+        // The decoder has flushed everything it can when it stops short of filling the output
+        if (input.pos == input.size && output.pos < output.size)
+        {
+          input_done = true;
+          break;
+        }
+      }
+
+      if (output.pos > 0)
+        publish_chunk(output.pos);
+
+      if (input_done)
+      {
+        if (last_result != 0)
+          throw std::runtime_error("truncated zstd data");
+        return;
+      }
+    }
+  }
+
+  char* decompressing_streambuf::acquire_chunk()
+  {
+    std::unique_lock lock{ mutex_ };
+    chunk_freed_.wait(lock, [this] { return cancelled_ || filled_count_ < chunks_.size(); });
+    return cancelled_ ? nullptr : chunks_[write_index_].data.get();
+  }
+
+  void decompressing_streambuf::publish_chunk(size_t size)
+  {
+    {
+      std::lock_guard lock{ mutex_ };
+      chunks_[write_index_].size = size;
+      write_index_ = (write_index_ + 1) % chunks_.size();
+      ++filled_count_;
+    }
+    chunk_filled_.notify_one();
+  }
+}
@@ -0,0 +1,81 @@
+/// This Source Code Form is subject to the terms of the Mozilla Public
+/// License, v. 2.0. If a copy of the MPL was not distributed with this
+/// file, You can obtain one at https://mozilla.org/MPL/2.0/.
+
+#pragma once
+
+#include <streambuf>
+#include <memory>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+
+#include "mmap.h"
+
+namespace ghassanpl
+{
+  enum class compression_format
+  {
+    none,
+    gzip,
+    zstd,
+  };
+
+  /// Detects gzip or zstd data by its magic bytes
+  compression_format detect_compression(const std::byte* data, size_t size) noexcept;
+
+  /// A read-only stream buffer that decompresses a memory-mapped file on a background thread.
+  /// The decompressed data is handed over through a fixed ring of `chunk_count` chunks, so the
+  /// decompressor never runs more than that far ahead of the reader.
+  struct decompressing_streambuf : public std::streambuf
+  {
+    static constexpr size_t default_chunk_size = 1 << 20;
+    static constexpr size_t default_chunk_count = 4;
+
+    decompressing_streambuf(mmap_source source, compression_format format, size_t chunk_size = default_chunk_size, size_t chunk_count = default_chunk_count);
+    ~decompressing_streambuf();
+
+    decompressing_streambuf(const decompressing_streambuf&) = delete;
+    decompressing_streambuf& operator=(const decompressing_streambuf&) = delete;
+
+  protected:
+
+    /// Rethrows any error raised by the decompression thread once all data decompressed before it has been read
+    int_type underflow() override;
+
+  private:
+
+    struct chunk
+    {
+      std::unique_ptr<char[]> data;
+      size_t size = 0;
+    };
+
+    void decompress(compression_format format);
+    void inflate_gzip();
+    void decompress_zstd();
+
+    /// Returns nullptr if the reader went away and decompression should stop
+    char* acquire_chunk();
+    void publish_chunk(size_t size);
+
+    mmap_source source_;
+    size_t chunk_size_ = 0;
+    std::vector<chunk> chunks_;
+
+    std::mutex mutex_;
+    std::condition_variable chunk_filled_;
+    std::condition_variable chunk_freed_;
+    size_t read_index_ = 0;
+    size_t write_index_ = 0;
+    size_t filled_count_ = 0;
+    bool reading_chunk_ = false;
+    bool finished_ = false;
+    bool cancelled_ = false;
+    std::exception_ptr error_;
+
+    std::thread thread_;
+  };
+}
@@ -5,25 +5,260 @@
 #include <iostream>
 #include <fstream>
 #include <filesystem>
+#include <algorithm>
+#include <set>
+#include <string_view>
+#include <map>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
 #include <nlohmann/json.hpp>
 
 #include "mmap.h"
+#include "decompress.h"
+#include "decode_buffer.h"
 #include "External\Turbo-Base64\turbob64.h"
 
 using namespace std;
 using namespace std::filesystem;
 using nlohmann::json;
 
+#if defined(_WIN32) && !defined(_WINDOWS_)
+extern "C" __declspec(dllimport) int __stdcall LCMapStringEx(const wchar_t* lpLocaleName, unsigned long dwMapFlags, const wchar_t* lpSrcStr, int cchSrc, wchar_t* lpDestStr, int cchDest, void* lpVersionInformation, void* lpReserved, intptr_t sortHandle);
+#endif
+
+/// In UTF-8 bytes; leaves room for a " (N)" suffix, the extension and ".partial" within the usual 255 character limit
+static constexpr size_t max_filename_stem_length = 200;
+
+/// Replaces characters that cannot appear in (Windows) filenames, shortens overly long names and steers clear of reserved device names
+string sanitize_filename(string name)
+{
+	for (auto& c : name)
+	{
+		if ((unsigned char)c < 32 || string_view{ "<>:\"/\\|?*" }.find(c) != string_view::npos)
+			c = '_';
+	}
+
+	if (name.size() > max_filename_stem_length)
+	{
+		auto end = max_filename_stem_length;
+		// Don't cut a UTF-8 sequence in half
+		while (end > 0 && ((unsigned char)name[end] & 0xC0) == 0x80)
+			--end;
+		name.resize(end);
+	}
+
+	while (!name.empty() && (name.back() == '.' || name.back() == ' '))
+		name.pop_back();
+	if (name.empty())
+		name = "unnamed";
+
+	auto stem = name.substr(0, name.find('.'));
+	transform(stem.begin(), stem.end(), stem.begin(), [](unsigned char c) { return (char)toupper(c); });
+	static const set<string> reserved_names = {
+		"CON", "PRN", "AUX", "NUL",
+		"COM1", "COM2", "COM3", "COM4", "COM5", "COM6", "COM7", "COM8", "COM9",
+		"LPT1", "LPT2", "LPT3", "LPT4", "LPT5", "LPT6", "LPT7", "LPT8", "LPT9",
+	};
+	if (reserved_names.count(stem))
+		name = "_" + name;
+
+	return name;
+}
+
+/// Returns the form under which the filesystem considers two names equal.
+/// NTFS ignores case using the invariant uppercase mapping of the whole of Unicode, so we use the same mapping on Windows;
+/// elsewhere filesystems are usually case-sensitive and only ASCII is folded.
+path::string_type fold_filename_case(string const& name)
+{
+	auto folded = u8path(name).native();
+#ifdef _WIN32
+	// LOCALE_NAME_INVARIANT, LCMAP_UPPERCASE
+	LCMapStringEx(L"", 0x00000200, folded.data(), (int)folded.size(), folded.data(), (int)folded.size(), nullptr, nullptr, 0);
+#else
+	transform(folded.begin(), folded.end(), folded.begin(), [](unsigned char c) { return (char)tolower(c); });
+#endif
+	return folded;
+}
+
+/// Appends " (2)", " (3)", etc. to `name` until the filesystem would consider it different from every name in `taken_names`
+string unique_filename(string const& name, set<path::string_type>& taken_names)
+{
+	auto result = name;
+	for (int i = 2; !taken_names.insert(fold_filename_case(result)).second; ++i)
+		result = name + " (" + to_string(i) + ")";
+	return result;
+}
+
+/// Writes to a temporary file next to `target`, flushes it to disk and renames it into place, so neither an interrupted run
+/// nor a crash of the whole system leaves a partial `target` behind
+void write_file_atomically(path const& target, const char* data, size_t size, ios::openmode mode = ios::binary)
+{
+	auto temporary = target;
+	temporary += ".partial";
+	{
+		ofstream output{ temporary, mode };
+		output.write(data, size);
+		output.close();
+		if (!output)
+			throw runtime_error("could not write " + temporary.filename().u8string());
+	}
+
+	// Otherwise a power loss or OS crash could keep the rename but not the data, leaving an empty `target` that reruns would trust
+	std::error_code error;
+	ghassanpl::flush_file(temporary, error);
+	if (error)
+		throw system_error(error, "could not flush " + temporary.filename().u8string());
+
+	std::filesystem::rename(temporary, target);
+}
+
+mutex console_mutex;
+
+/// Writes a whole line to cout, without it getting interleaved with lines printed by other threads
+void print_line(string const& line)
+{
+	lock_guard lock{ console_mutex };
+	cout << line << "\n";
+}
+
+/// A base64-encoded asset along with the files it should be decoded into
+struct decode_job
+{
+	string base64;
+	vector<string> filenames;
+};
+
+/// Decodes assets and writes them to disk on a pool of worker threads.
+/// Jobs are handed over through a bounded queue, so the parser can keep going while earlier assets are decoded,
+/// without ever holding more than a few assets' worth of base64 data in flight.
+struct asset_writer
+{
+	asset_writer(path output_directory, size_t worker_count)
+		: output_directory_(std::move(output_directory))
+		, queue_capacity_(worker_count)
+	{
+		for (size_t i = 0; i < worker_count; ++i)
+			workers_.emplace_back(&asset_writer::work, this);
+	}
+
+	~asset_writer() { finish(); }
+
+	asset_writer(asset_writer const&) = delete;
+	asset_writer& operator=(asset_writer const&) = delete;
+
+	/// Blocks while the queue is full
+	void push(decode_job job)
+	{
+		{
+			unique_lock lock{ mutex_ };
+			queue_not_full_.wait(lock, [this] { return queue_.size() < queue_capacity_; });
+			queue_.push_back(std::move(job));
+		}
+		queue_not_empty_.notify_one();
+	}
+
+	/// Waits for every queued asset to be written; returns false if any of them could not be
+	bool finish()
+	{
+		{
+			lock_guard lock{ mutex_ };
+			closing_ = true;
+		}
+		queue_not_empty_.notify_all();
+		for (auto& worker : workers_)
+			worker.join();
+		workers_.clear();
+		return !failed_;
+	}
+
+private:
+
+	void work()
+	{
+		while (true)
+		{
+			decode_job job;
+			{
+				unique_lock lock{ mutex_ };
+				queue_not_empty_.wait(lock, [this] { return !queue_.empty() || closing_; });
+				if (queue_.empty())
+					return;
+				job = std::move(queue_.front());
+				queue_.pop_front();
+			}
+			queue_not_full_.notify_one();
+
+			if (!write(job))
+				failed_ = true;
+		}
+	}
+
+	bool write(decode_job const& job)
+	{
+		auto const& b64 = job.base64;
+		auto len = tb64declen((const unsigned char*)b64.data(), b64.size());
+		auto output_buffer = ghassanpl::thread_decode_buffer().reserve(len);
+		// Turbo-Base64 reports malformed input (including lengths that aren't a multiple of 4) by returning 0 from both functions
+		const auto valid = (len > 0 || b64.empty()) && tb64dec((const unsigned char*)b64.data(), b64.size(), output_buffer) == len;
+		if (!valid)
+		{
+			// The decode buffer is reused and never cleared, so a short decode would leave bytes of a previous asset in the output
+			for (auto& filename : job.filenames)
+				print_line("ERROR: " + filename + ": asset data is not valid base64, skipping");
+			return false;
+		}
+
+		bool ok = true;
+		for (auto& filename : job.filenames)
+		{
+			try
+			{
+				print_line("Outputting " + filename);
+				write_file_atomically(output_directory_ / u8path(filename), (const char*)output_buffer, len);
+			}
+			catch (exception const& e)
+			{
+				print_line("ERROR: " + filename + ": " + e.what());
+				ok = false;
+			}
+		}
+		return ok;
+	}
+
+	path output_directory_;
+	size_t queue_capacity_ = 0;
+
+	mutex mutex_;
+	condition_variable queue_not_empty_;
+	condition_variable queue_not_full_;
+	deque<decode_job> queue_;
+	bool closing_ = false;
+	atomic<bool> failed_{ false };
+
+	vector<thread> workers_;
+};
+
 int main(int argc, const char** argv)
 {
-	if (argc < 2)
+	int arg = 1;
+	bool large_pages = false;
+	if (arg < argc && argv[arg] == string_view{ "--large-pages" })
+	{
+		large_pages = true;
+		++arg;
+	}
+
+	if (arg >= argc)
 	{
 		path p = argv[0];
-		cout << "Usage: " << p.filename().string() << " <filename.owlbear>\n";
+		cout << "Usage: " << p.filename().string() << " [--large-pages] <filename.owlbear[.gz|.zst]>\n";
 		return 1;
 	}
 
-	path p = absolute(argv[1]);
+	path p = absolute(argv[arg]);
 	if (!is_regular_file(p))
 	{
 		cout << "ERROR: " << p.filename().string() << " is not a file\n";
@@ -32,65 +267,178 @@ int main(int argc, const char** argv)
 
 	path output_directory = p.parent_path();
 
+	if (large_pages && !ghassanpl::enable_large_pages())
+		cout << "NOTE: could not enable large pages (this needs the \"Lock pages in memory\" privilege), using regular pages\n";
+
 	try
 	{
-		auto owlbear_file = ghassanpl::make_mmap_source(p);
-		auto owlbear_json = json::parse(owlbear_file);
-		auto const& data_array = owlbear_json["data"]["data"];
+		// Decompression (if any), parsing and base64 decoding each get their own thread(s)
+		const auto cores = thread::hardware_concurrency();
+		asset_writer writer{ output_directory, cores > 3 ? cores - 2 : 1 };
+
+		// Output names are resolved on the parsing thread, in file order, so reruns map each map to the same files
+		// and the decode workers never have to coordinate on filenames
+		set<path::string_type> taken_names;
+		map<string, vector<string>> pending_map_names_by_file_id;
+		bool failed = false;
+
+		auto export_map = [&](json& map) {
+			if (map["file"].is_null())
+			{
+				print_line("NOTE: map " + string{ map["name"] } + " does not have an asset associated with it");
+				return;
+			}
+			if (!map["file"].is_string())
+			{
+				print_line("ERROR: map " + string{ map["name"] } + " has an invalid asset id, skipping");
+				failed = true;
+				return;
+			}
 
-		json const* asset_array = {};
-		json const* map_array = {};
-		for (auto& d : data_array)
+			auto name = unique_filename(sanitize_filename(string{ map["name"] }), taken_names);
+			// A map that cannot be written should not stop the rest of the export
+			try
+			{
+				auto json_filename = name + ".json";
+				auto json_path = output_directory / u8path(json_filename);
+				if (exists(json_path))
+					print_line("Skipping " + json_filename + ", already exists");
+				else
+				{
+					// Text mode, so the .json keeps the platform's line endings
+					auto map_json = map.dump(2);
+					write_file_atomically(json_path, map_json.data(), map_json.size(), ios::out);
+				}
+			}
+			catch (exception const& e)
+			{
+				print_line("ERROR: " + name + ": " + e.what());
+				failed = true;
+			}
+
+			pending_map_names_by_file_id[map["file"].get<string>()].push_back(std::move(name));
+		};
+
+		// Returns true if the asset was handed over to the writer and is no longer needed
+		auto export_asset = [&](json& asset) {
+			if (!asset["id"].is_string())
+				return false;
+			auto pending = pending_map_names_by_file_id.find(asset["id"].get<string>());
+			if (pending == pending_map_names_by_file_id.end())
+				return false;
+
+			auto names = std::move(pending->second);
+			pending_map_names_by_file_id.erase(pending);
+			try
+			{
+				auto extension = string{ asset["mime"] }.substr(6);
+				decode_job job;
+				for (auto& name : names)
+				{
+					auto filename = name + "." + extension;
+					if (exists(output_directory / u8path(filename)))
+						print_line("Skipping " + filename + ", already exists");
+					else
+						job.filenames.push_back(std::move(filename));
+				}
+
+				if (!job.filenames.empty())
+				{
+					job.base64 = std::move(asset["file"]["buffer"].get_ref<string&>());
+					writer.push(std::move(job));
+				}
+			}
+			catch (exception const& e)
+			{
+				print_line("ERROR: " + names.front() + ": " + e.what());
+				failed = true;
+			}
+			return true;
+		};
+
+		// Maps are exported, and map assets handed to the decode workers, as soon as the parser finishes each row of
+		// `data.data[].rows`. Exported rows are dropped from the document instead of being kept until the end.
+		// This can only happen for tables whose "tableName" comes before their "rows", as it does in Dexie exports;
+		// other tables, and assets that arrive before their map, are left in the document and exported after parsing.
+		vector<string> keys;
+		string current_table;
+		bool has_maps = false, has_assets = false;
+		auto on_parse_event = [&](int depth, json::parse_event_t event, json& parsed) {
+			if (event == json::parse_event_t::key)
+			{
+				if (keys.size() <= size_t(depth))
+					keys.resize(depth + 1);
+				keys[depth] = parsed.get<string>();
+				return true;
+			}
+
+			if (depth < 3 || keys.size() < 5 || keys[1] != "data" || keys[2] != "data")
+				return true;
+
+			if (event == json::parse_event_t::value && depth == 4 && keys[4] == "tableName")
+			{
+				current_table = parsed.is_string() ? parsed.get<string>() : string{};
+				has_maps |= current_table == "maps";
+				has_assets |= current_table == "assets";
+			}
+			else if (event == json::parse_event_t::object_end && depth == 3)
+				current_table.clear();
+			else if (event == json::parse_event_t::object_end && depth == 5 && keys[4] == "rows")
+			{
+				if (current_table == "maps")
+				{
+					export_map(parsed);
+					return false;
+				}
+				if (current_table == "assets")
+					return !export_asset(parsed);
+			}
+			return true;
+		};
+
+		auto owlbear_file = ghassanpl::make_mmap_source(p);
+		json owlbear_json;
+		if (auto format = ghassanpl::detect_compression(owlbear_file.data(), owlbear_file.size()); format != ghassanpl::compression_format::none)
 		{
-			if (d["tableName"] == "maps")
-				map_array = &d["rows"];
-			else if (d["tableName"] == "assets")
-				asset_array = &d["rows"];
+			ghassanpl::decompressing_streambuf decompressed_file{ std::move(owlbear_file), format };
+			istream decompressed_stream{ &decompressed_file };
+			owlbear_json = json::parse(decompressed_stream, on_parse_event);
 		}
+		else
+			owlbear_json = json::parse(owlbear_file, on_parse_event);
 
-		if (!asset_array || !map_array)
+		if (!has_assets || !has_maps)
 		{
 			cout << "ERROR: " << p.filename().string() << ": no maps or assets in file\n";
 			return 1;
 		}
 
-		map<string, string> map_name_to_image_id;
-		for (auto& map : *map_array)
+		for (auto& d : owlbear_json["data"]["data"])
 		{
-			if (!map["file"].is_null())
+			if (d["tableName"] == "maps")
 			{
-				auto name = string{ map["name"] } + ".json";
-				ofstream output{ output_directory / name };
-				output << map.dump(2);
-
-				map_name_to_image_id[map["name"]] = map["file"];
-			}
-			else {
-				cout << "NOTE: map " << string{ map["name"] } << " does not have an asset associated with it\n";
+				for (auto& map : d["rows"])
+					export_map(map);
 			}
 		}
 
-		for (auto& [name, file_id] : map_name_to_image_id)
+		if (!pending_map_names_by_file_id.empty())
 		{
-			for (auto& asset : *asset_array)
+			for (auto& d : owlbear_json["data"]["data"])
 			{
-				if (asset["id"] == file_id)
+				if (d["tableName"] == "assets")
 				{
-					auto const& b64 = asset["file"]["buffer"].get_ref<std::string const&>();
-					auto filename = name + "." + string{ asset["mime"] }.substr(6);
-
-					cout << "Outputting " << filename << "\n";
-
-					auto len = tb64declen((const unsigned char*)b64.data(), b64.size());
-					vector<uint8_t> output_buffer;
-					output_buffer.resize(len);
-					tb64dec((const unsigned char*)b64.data(), b64.size(), output_buffer.data());
-
-					ofstream output{ output_directory / filename, ios::binary };
-					output.write((const char*)output_buffer.data(), output_buffer.size());
+					for (auto& asset : d["rows"])
+						export_asset(asset);
 				}
 			}
 		}
+
+		if (!writer.finish())
+			failed = true;
+
+		cout << "Peak decode buffer pool size: " << ghassanpl::peak_decode_buffer_pool_size() << " bytes\n";
+		return failed ? 1 : 0;
 	}
 	catch (exception const& e)
 	{
@@ -80,6 +80,31 @@ namespace ghassanpl
     }
   }
 
+  void flush_file(const std::filesystem::path& path, std::error_code& error) noexcept
+  {
+    error.clear();
+#ifdef _WIN32
+    const auto handle = CreateFileW(path.c_str(), (0x40000000L), 0x00000001 | 0x00000002, 0, 3, 0x00000080, 0);
+#else // POSIX
+    const auto handle = ::open(path.c_str(), O_WRONLY);
+#endif
+    if (handle == invalid_handle)
+    {
+      error = last_error();
+      return;
+    }
+
+#ifdef _WIN32
+    if (FlushFileBuffers(handle) == 0)
+      error = last_error();
+    CloseHandle(handle);
+#else // POSIX
+    if (::fsync(handle) != 0)
+      error = last_error();
+    ::close(handle);
+#endif
+  }
+
   void mmap_sink::sync(std::error_code& error) noexcept
   {
     error.clear();
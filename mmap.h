@@ -301,6 +301,9 @@ namespace ghassanpl
   };
 
 
+  /// Makes sure everything written to the file at `path` so far has reached the disk
+  void flush_file(const std::filesystem::path& path, std::error_code& error) noexcept;
+
   inline mmap_source make_mmap_source(const std::filesystem::path& path, mmap_source::size_type offset, mmap_source::size_type length, std::error_code& error) noexcept
   {
     mmap_source mmap;